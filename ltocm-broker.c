@@ -0,0 +1,688 @@
+/***
+ * ltocm-broker: Share LTO-CM readers between local clients
+ *
+ * Phil Pemberton <philpem@philpem.me.uk>
+ * github.com/philpem
+ * www.philpem.me.uk
+ *
+ * Licence: 2-clause BSD, see README.md
+ *
+ * libnfc devices can only be opened by one process at a time. The broker
+ * owns the readers and answers requests from other programs over a Unix
+ * domain socket.
+ *
+ * Requests are lines of text. Each is answered in order:
+ *
+ *   READ [n]       Image of the tag on reader n (default 0)
+ *   GET ssssssss   Image of the tag with serial number ssssssss (8 hex
+ *                  digits), on whichever reader it is on
+ *   STATUS         One line per reader: "READER n ssssssss name", with "-"
+ *                  for the serial number if no tag is present, then "END"
+ *
+ * An image is sent as "OK ssssssss tttt length", where tttt is the REQUEST
+ * STANDARD response, followed by length bytes of image data. Failures are
+ * sent as "ERR message".
+ *
+ * Images are cached per reader until the tag leaves the field. Before
+ * answering, the broker checks which tag is in each reader it needs (this
+ * only takes a couple of short commands), so a cached image is never served
+ * for a tag that has gone. Requests which arrive together share one check
+ * and at most one full read of each tag.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include <nfc/nfc.h>
+
+#include "nfc-ltocm.h"
+#include "nfc-utils.h"
+
+
+/// Default socket path
+#define DEFAULT_SOCKET_PATH "/tmp/ltocm-broker.sock"
+
+/// Default time between checks for removed tags, in milliseconds
+#define DEFAULT_POLL_INTERVAL 1000
+
+#define MAX_READERS 8
+#define MAX_CLIENTS 32
+
+/// Longest request line, including the newline
+#define MAX_REQUEST_LEN 64
+
+/// Seconds to wait for a client to accept a response before dropping it
+#define CLIENT_SEND_TIMEOUT 2
+
+/// An NFC reader, and the tag in its field
+typedef struct {
+	nfc_device *pnd;
+	bool wanted;				///< A pending request needs this reader checked
+	bool present;				///< A tag was in the field at the last check
+	bool cached;				///< image holds the contents of the tag in the field
+	bool readFailed;			///< Reading the tag failed since the last check
+	uint64_t lastCheck;			///< Time of the last check, from now_ms()
+	uint8_t serialNum[5];		///< Serial number of the tag in the field
+	uint8_t ltoStandard[2];
+	uint8_t image[LTOCM_MAX_IMAGE];
+	size_t imageLen;
+} reader;
+
+/// A connected client
+typedef struct {
+	int fd;
+	char buf[MAX_REQUEST_LEN];	///< Received data not yet processed
+	size_t len;
+} client;
+
+typedef enum {
+	REQ_BAD,
+	REQ_READ,
+	REQ_GET,
+	REQ_STATUS
+} request_type;
+
+typedef struct {
+	request_type type;
+	size_t reader;				///< REQ_READ: reader number
+	uint8_t serialNum[4];		///< REQ_GET: serial number
+} request;
+
+static reader readers[MAX_READERS];
+static size_t numReaders;
+
+static client clients[MAX_CLIENTS];
+static size_t numClients;
+
+static volatile sig_atomic_t quit;
+
+
+/***
+ * Utility functions
+ ***/
+
+/// Monotonic time in milliseconds.
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+/// Send a whole buffer to a client.
+static bool send_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+	while (len > 0) {
+		ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool send_line(int fd, const char *line)
+{
+	return send_all(fd, line, strlen(line));
+}
+
+/// Parse a request line (without its newline).
+static request parse_request(const char *line)
+{
+	request req = { REQ_BAD, 0, { 0 } };
+	char arg[MAX_REQUEST_LEN];
+	char cmd[MAX_REQUEST_LEN];
+	char extra;
+
+	int n = sscanf(line, "%63s %63s %c", cmd, arg, &extra);
+	if (n < 1 || n > 2)
+		return req;
+
+	if (strcmp(cmd, "READ") == 0) {
+		char *end;
+		req.reader = 0;
+		if (n == 2) {
+			req.reader = strtoul(arg, &end, 10);
+			if (!isdigit((unsigned char)arg[0]) || *end != '\0')
+				return req;
+		}
+		req.type = REQ_READ;
+	} else if ((strcmp(cmd, "GET") == 0) && (n == 2)) {
+		if (strlen(arg) != 8)
+			return req;
+		for (size_t i = 0; i < 8; i++) {
+			if (!isxdigit((unsigned char)arg[i]))
+				return req;
+		}
+		for (size_t i = 0; i < 4; i++) {
+			char byte[3] = { arg[i*2], arg[i*2 + 1], '\0' };
+			req.serialNum[i] = strtoul(byte, NULL, 16);
+		}
+		req.type = REQ_GET;
+	} else if ((strcmp(cmd, "STATUS") == 0) && (n == 1)) {
+		req.type = REQ_STATUS;
+	}
+
+	return req;
+}
+
+
+/***
+ * Readers
+ ***/
+
+/**
+ * Check which tag is in a reader's field.
+ *
+ * The cached image is dropped if the tag has left the field, or been
+ * replaced by another one.
+ */
+static void check_reader(size_t n)
+{
+	reader *r = &readers[n];
+	uint8_t ltoStandard[2];
+	uint8_t serialNum[5];
+	int serialNumLen = 0;
+
+	ltocm_set_device(r->pnd);
+	r->readFailed = false;
+	r->lastCheck = now_ms();
+
+	bool found = ltocm_field_reset() &&
+		ltocm_req_std(ltoStandard) &&
+		ltocm_req_serial(serialNum, &serialNumLen) &&
+		(serialNumLen >= 5) &&
+		((serialNum[0] ^ serialNum[1] ^ serialNum[2] ^ serialNum[3]) == serialNum[4]);
+
+	if (found && r->present && (memcmp(serialNum, r->serialNum, 4) == 0))
+		return;
+
+	if (r->present) {
+		printf("Reader %zu: tag %02X%02X%02X%02X removed\n", n,
+				r->serialNum[0], r->serialNum[1], r->serialNum[2], r->serialNum[3]);
+	}
+
+	r->present = found;
+	r->cached = false;
+	if (found) {
+		memcpy(r->serialNum, serialNum, sizeof(serialNum));
+		printf("Reader %zu: tag %02X%02X%02X%02X arrived\n", n,
+				serialNum[0], serialNum[1], serialNum[2], serialNum[3]);
+	}
+}
+
+/**
+ * Get the image of the tag in a reader's field, reading it if it isn't cached.
+ *
+ * The reader must have been checked with check_reader() first. A failed read
+ * is not retried until the reader is checked again.
+ */
+static bool read_reader(size_t n)
+{
+	reader *r = &readers[n];
+	uint8_t serialNum[5];
+
+	if (!r->present || r->readFailed)
+		return false;
+	if (r->cached)
+		return true;
+
+	ltocm_set_device(r->pnd);
+	if (!ltocm_field_reset() ||
+			!ltocm_read_tag(r->ltoStandard, serialNum, r->image, &r->imageLen) ||
+			(memcmp(serialNum, r->serialNum, 4) != 0)) {
+		printf("Reader %zu: failed to read tag\n", n);
+		r->readFailed = true;
+		return false;
+	}
+
+	r->cached = true;
+	return true;
+}
+
+
+/***
+ * Clients
+ ***/
+
+static void drop_client(size_t n)
+{
+	close(clients[n].fd);
+	clients[n] = clients[--numClients];
+}
+
+static bool send_image(int fd, const reader *r)
+{
+	char line[MAX_REQUEST_LEN];
+	snprintf(line, sizeof(line), "OK %02X%02X%02X%02X %02X%02X %zu\n",
+			r->serialNum[0], r->serialNum[1], r->serialNum[2], r->serialNum[3],
+			r->ltoStandard[0], r->ltoStandard[1], r->imageLen);
+	return send_line(fd, line) && send_all(fd, r->image, r->imageLen);
+}
+
+/// Answer one request.
+static bool answer_request(int fd, const request *req)
+{
+	char line[MAX_REQUEST_LEN + 256];
+
+	switch (req->type) {
+		case REQ_READ:
+			if (req->reader >= numReaders)
+				return send_line(fd, "ERR no such reader\n");
+			if (!readers[req->reader].present)
+				return send_line(fd, "ERR no tag present\n");
+			if (!read_reader(req->reader))
+				return send_line(fd, "ERR read failed\n");
+			return send_image(fd, &readers[req->reader]);
+
+		case REQ_GET:
+			for (size_t i = 0; i < numReaders; i++) {
+				if (!readers[i].present || (memcmp(readers[i].serialNum, req->serialNum, 4) != 0))
+					continue;
+				if (!read_reader(i))
+					return send_line(fd, "ERR read failed\n");
+				return send_image(fd, &readers[i]);
+			}
+			return send_line(fd, "ERR tag not found\n");
+
+		case REQ_STATUS:
+			for (size_t i = 0; i < numReaders; i++) {
+				const reader *r = &readers[i];
+				if (r->present) {
+					snprintf(line, sizeof(line), "READER %zu %02X%02X%02X%02X %s\n", i,
+							r->serialNum[0], r->serialNum[1], r->serialNum[2], r->serialNum[3],
+							nfc_device_get_name(r->pnd));
+				} else {
+					snprintf(line, sizeof(line), "READER %zu - %s\n", i, nfc_device_get_name(r->pnd));
+				}
+				if (!send_line(fd, line))
+					return false;
+			}
+			return send_line(fd, "END\n");
+
+		default:
+			return send_line(fd, "ERR bad request\n");
+	}
+}
+
+/**
+ * Call fn for every complete request line waiting in a client's buffer.
+ *
+ * @return	false if fn failed, and the client should be dropped.
+ */
+static bool for_each_request(client *c, bool (*fn)(int fd, const request *req))
+{
+	char line[MAX_REQUEST_LEN];
+	size_t start = 0;
+
+	for (size_t i = 0; i < c->len; i++) {
+		if (c->buf[i] != '\n')
+			continue;
+
+		size_t len = i - start;
+		memcpy(line, &c->buf[start], len);
+		line[len] = '\0';
+		if (len > 0 && line[len - 1] == '\r')
+			line[len - 1] = '\0';
+		start = i + 1;
+
+		request req = parse_request(line);
+		if (!fn(c->fd, &req))
+			return false;
+	}
+	return true;
+}
+
+/// Mark the readers a request will need checked.
+static bool want_readers(int fd, const request *req)
+{
+	(void)fd;
+	if (req->type == REQ_READ) {
+		if (req->reader < numReaders)
+			readers[req->reader].wanted = true;
+	} else if (req->type == REQ_GET || req->type == REQ_STATUS) {
+		for (size_t i = 0; i < numReaders; i++)
+			readers[i].wanted = true;
+	}
+	return true;
+}
+
+/**
+ * Answer every complete request from every client.
+ *
+ * Each reader any of the requests needs is checked once, then the requests
+ * are answered in order. A tag is read at most once, however many requests
+ * want it.
+ */
+static void process_requests(void)
+{
+	for (size_t i = 0; i < numClients; i++)
+		for_each_request(&clients[i], want_readers);
+
+	for (size_t i = 0; i < numReaders; i++) {
+		if (readers[i].wanted)
+			check_reader(i);
+		readers[i].wanted = false;
+	}
+
+	for (size_t i = 0; i < numClients; ) {
+		client *c = &clients[i];
+		if (!for_each_request(c, answer_request)) {
+			drop_client(i);
+			continue;
+		}
+
+		// Keep any partial request for next time
+		char *lastNewline = NULL;
+		for (size_t j = 0; j < c->len; j++) {
+			if (c->buf[j] == '\n')
+				lastNewline = &c->buf[j];
+		}
+		if (lastNewline != NULL) {
+			size_t used = lastNewline - c->buf + 1;
+			memmove(c->buf, &c->buf[used], c->len - used);
+			c->len -= used;
+		}
+		i++;
+	}
+}
+
+/**
+ * Read whatever a client has sent.
+ *
+ * @return	false if the client disconnected, or sent an overlong request.
+ */
+static bool receive_from_client(client *c)
+{
+	ssize_t n = recv(c->fd, &c->buf[c->len], sizeof(c->buf) - c->len, 0);
+	if (n < 0 && errno == EINTR)
+		return true;
+	if (n <= 0)
+		return false;
+	c->len += n;
+
+	if ((c->len == sizeof(c->buf)) && (memchr(c->buf, '\n', c->len) == NULL)) {
+		send_line(c->fd, "ERR request too long\n");
+		return false;
+	}
+	return true;
+}
+
+static void accept_client(int listenFd)
+{
+	int fd = accept(listenFd, NULL, NULL);
+	if (fd < 0)
+		return;
+
+	if (numClients == MAX_CLIENTS) {
+		send_line(fd, "ERR too many clients\n");
+		close(fd);
+		return;
+	}
+
+	// Don't let a client which stops reading hold up everyone else
+	struct timeval tv = { CLIENT_SEND_TIMEOUT, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	clients[numClients].fd = fd;
+	clients[numClients].len = 0;
+	numClients++;
+}
+
+
+/***
+ * Main
+ ***/
+
+/**
+ * Remove a socket left behind by a broker which has exited.
+ *
+ * Anything which isn't a socket is left alone, and so is a socket which
+ * another broker is still listening on.
+ *
+ * @return	false if the path is in use and can't be listened on.
+ */
+static bool remove_stale_socket(const struct sockaddr_un *addr)
+{
+	struct stat st;
+	if (lstat(addr->sun_path, &st) != 0)
+		return true;
+
+	if (!S_ISSOCK(st.st_mode)) {
+		printf("Error: '%s' exists and is not a socket\n", addr->sun_path);
+		return false;
+	}
+
+	// Only a socket nobody is listening on refuses connections
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return false;
+	}
+	bool stale = (connect(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0) && (errno == ECONNREFUSED);
+	close(fd);
+
+	if (!stale) {
+		printf("Error: another broker is already listening on '%s'\n", addr->sun_path);
+		return false;
+	}
+	if (unlink(addr->sun_path) != 0) {
+		printf("Error: cannot remove stale socket '%s'\n", addr->sun_path);
+		return false;
+	}
+	return true;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-s socket] [-i interval] [-d connstring ...]\n", progname);
+	fprintf(stderr, "  -s socket      Unix socket to listen on (default %s)\n", DEFAULT_SOCKET_PATH);
+	fprintf(stderr, "  -i interval    Milliseconds between checks for removed tags (default %d)\n", DEFAULT_POLL_INTERVAL);
+	fprintf(stderr, "  -d connstring  libnfc device to use; may be repeated (default: all devices)\n");
+}
+
+int main(int argc, char **argv)
+{
+	int returncode = EXIT_SUCCESS;
+	const char *socketPath = DEFAULT_SOCKET_PATH;
+	int pollInterval = DEFAULT_POLL_INTERVAL;
+	nfc_connstring connstrings[MAX_READERS];
+	size_t numConnstrings = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "s:i:d:")) != -1) {
+		switch (opt) {
+			case 's':
+				socketPath = optarg;
+				break;
+			case 'i':
+				pollInterval = atoi(optarg);
+				if (pollInterval <= 0) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'd':
+				if (numConnstrings == MAX_READERS) {
+					printf("Error: too many readers (max %d)\n", MAX_READERS);
+					exit(EXIT_FAILURE);
+				}
+				snprintf(connstrings[numConnstrings++], sizeof(nfc_connstring), "%s", optarg);
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if (optind != argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	// We're a daemon: make sure log lines come out as they happen
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	// Initialise libnfc
+	nfc_context *context;
+	nfc_init(&context);
+	if (context == NULL) {
+		ERR("Unable to init libnfc (malloc)");
+		exit(EXIT_FAILURE);
+	}
+
+	// Open the readers
+	if (numConnstrings == 0)
+		numConnstrings = nfc_list_devices(context, connstrings, MAX_READERS);
+
+	for (size_t i = 0; i < numConnstrings; i++) {
+		nfc_device *pnd = nfc_open(context, connstrings[i]);
+		if (pnd == NULL) {
+			ERR("Error opening NFC reader %s", connstrings[i]);
+			continue;
+		}
+		if (!ltocm_init_device(pnd)) {
+			nfc_close(pnd);
+			continue;
+		}
+
+		memset(&readers[numReaders], 0, sizeof(readers[numReaders]));
+		readers[numReaders].pnd = pnd;
+		printf("Reader %zu: %s opened\n", numReaders, nfc_device_get_name(pnd));
+		numReaders++;
+	}
+
+	if (numReaders == 0) {
+		ERR("No NFC readers could be opened");
+		nfc_exit(context);
+		exit(EXIT_FAILURE);
+	}
+
+	// Listen on the socket
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+		printf("Error: socket path '%s' is too long\n", socketPath);
+		returncode = EXIT_FAILURE;
+		goto err_exit;
+	}
+	strcpy(addr.sun_path, socketPath);
+
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		perror("socket");
+		returncode = EXIT_FAILURE;
+		goto err_exit;
+	}
+
+	if (!remove_stale_socket(&addr)) {
+		close(listenFd);
+		returncode = EXIT_FAILURE;
+		goto err_exit;
+	}
+
+	// Remember which file is our socket, so we don't remove a newer broker's at exit
+	struct stat sockStat;
+	if ((bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) || (listen(listenFd, MAX_CLIENTS) != 0) ||
+			(lstat(socketPath, &sockStat) != 0)) {
+		printf("Error: cannot listen on socket '%s'\n", socketPath);
+		close(listenFd);
+		returncode = EXIT_FAILURE;
+		goto err_exit;
+	}
+	printf("Listening on %s\n", socketPath);
+
+	// Shut down cleanly on SIGINT and SIGTERM. No SA_RESTART, so poll() wakes up.
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	while (!quit) {
+		struct pollfd fds[MAX_CLIENTS + 1];
+
+		fds[0].fd = listenFd;
+		fds[0].events = POLLIN;
+		for (size_t i = 0; i < numClients; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+		}
+
+		int ready = poll(fds, numClients + 1, pollInterval);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			returncode = EXIT_FAILURE;
+			break;
+		}
+
+		// Drop cached images of tags which have been taken away. This runs on
+		// every pass, so a busy reader can't stop the others being checked.
+		uint64_t now = now_ms();
+		for (size_t i = 0; i < numReaders; i++) {
+			if (readers[i].present && (now - readers[i].lastCheck >= (uint64_t)pollInterval))
+				check_reader(i);
+		}
+
+		if (ready == 0)
+			continue;
+
+		// Collect requests from clients, newest connections last. Walk
+		// backwards, as dropping a client moves the last one into its slot.
+		size_t polledClients = numClients;
+		for (size_t i = polledClients; i > 0; i--) {
+			if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) && !receive_from_client(&clients[i - 1]))
+				drop_client(i - 1);
+		}
+
+		if (fds[0].revents & POLLIN)
+			accept_client(listenFd);
+
+		process_requests();
+	}
+
+	printf("Shutting down\n");
+	for (size_t i = 0; i < numClients; i++)
+		close(clients[i].fd);
+	close(listenFd);
+
+	struct stat st;
+	if ((lstat(socketPath, &st) == 0) && (st.st_dev == sockStat.st_dev) && (st.st_ino == sockStat.st_ino))
+		unlink(socketPath);
+
+err_exit:
+	for (size_t i = 0; i < numReaders; i++)
+		nfc_close(readers[i].pnd);
+	nfc_exit(context);
+	exit(returncode);
+}
@@ -0,0 +1,546 @@
+/***
+ * ltocm-gen: Generate synthetic LTO-CM images
+ *
+ * Phil Pemberton <philpem@philpem.me.uk>
+ * github.com/philpem
+ * www.philpem.me.uk
+ *
+ * Licence: 2-clause BSD, see README.md
+ *
+ * Produces a corpus of made-up LTO-CM images, for testing and benchmarking
+ * tools which decode, index or verify images without needing anyone's real
+ * tapes. Output is deterministic: image n from a given seed is always the
+ * same, whatever else is generated alongside it.
+ *
+ * Block 0 is laid out the way nfc-ltocm checks it: serial number, serial
+ * check byte, and the LTO-CM type in bytes 6:7. The rest of the image follows
+ * the structure of ECMA-319 Annex D (a page table, then pages with a 4-byte
+ * ID/length header) with plausible, self-consistent contents. It is not a
+ * byte-exact copy of what any drive writes.
+ *
+ * References:
+ *   ECMA-319: https://www.ecma-international.org/publications/files/ECMA-ST/ECMA-319.pdf
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include <unistd.h>
+
+#include "nfc-ltocm.h"
+#include "ltocm-pack.h"
+
+
+/// Offset of the first page, after Block 0 and the page table
+#define FIRST_PAGE_OFFSET 96
+
+/***
+ * ECMA-319 Annex D page IDs
+ ***/
+#define PAGE_CARTRIDGE_MFR		0x001	///< Cartridge Manufacturer's Information
+#define PAGE_MEDIA_MFR			0x002	///< Media Manufacturer's Information
+#define PAGE_INIT_DATA			0x101	///< Initialisation Data
+#define PAGE_TAPE_WRITE_PASS	0x102	///< Tape Write Pass
+#define PAGE_TAPE_DIRECTORY		0x103	///< Tape Directory
+#define PAGE_EOD_INFO			0x104	///< EOD Information
+#define PAGE_CARTRIDGE_STATUS	0x105	///< Cartridge Status and Tape Alert Flags
+#define PAGE_MECHANISM			0x106	///< Mechanism Related
+#define PAGE_SUSPENDED_WRITES	0x107	///< Suspended Append Writes
+#define PAGE_USAGE_INFO_0		0x108	///< Usage Information 0 (to 3, at 0x10B)
+#define PAGE_APPLICATION		0x200	///< Application Specific
+
+/// Page table terminator
+#define PAGE_END				0xFFFF
+
+/// Number of Usage Information pages (one per recent drive)
+#define NUM_USAGE_PAGES 4
+
+#ifndef MIN
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#endif
+
+
+/// An LTO generation, and what its cartridges look like
+typedef struct {
+	int generation;
+	uint16_t ltocmType;			///< LTO-CM type, as returned by REQUEST STANDARD
+	uint8_t densityCode;		///< SCSI density code
+	uint16_t wraps;				///< Number of wraps on the tape
+	uint16_t tapeLength;		///< Tape length in metres
+	uint32_t capacityMB;		///< Native capacity in MB
+	uint16_t firstYear;			///< Year media first shipped
+	uint8_t weight;				///< Percentage of generated images
+} lto_generation;
+
+static const lto_generation generations[] = {
+	{ 1, 0x0001, 0x40,  48, 609,    100000, 2000,  5 },
+	{ 2, 0x0001, 0x42,  64, 609,    200000, 2003,  5 },
+	{ 3, 0x0001, 0x44,  44, 680,    400000, 2005, 10 },
+	{ 4, 0x0002, 0x46,  56, 820,    800000, 2007, 15 },
+	{ 5, 0x0002, 0x58,  80, 846,   1500000, 2010, 20 },
+	{ 6, 0x0003, 0x5A, 136, 846,   2500000, 2012, 15 },
+	{ 7, 0x0003, 0x5C, 112, 960,   6000000, 2015, 15 },
+	{ 8, 0x0003, 0x5E, 208, 960,  12000000, 2017, 10 },
+	{ 9, 0x0003, 0x60, 280, 1035, 18000000, 2021,  5 },
+};
+
+#define NUM_GENERATIONS (sizeof(generations) / sizeof(generations[0]))
+
+static const char *cartridgeMfrs[] = { "FUJIFILM", "SONY    ", "HP      ", "IBM     ", "QUANTUM ", "MAXELL  ", "TDK     " };
+static const char *driveMfrs[]     = { "IBM     ", "HP      ", "QUANTUM ", "TANDBERG", "CERTANCE" };
+
+#define NUM_CARTRIDGE_MFRS (sizeof(cartridgeMfrs) / sizeof(cartridgeMfrs[0]))
+#define NUM_DRIVE_MFRS (sizeof(driveMfrs) / sizeof(driveMfrs[0]))
+
+
+/***
+ * Utility functions
+ ***/
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+	p[0] = (v >> 8) & 0xff;
+	p[1] = v & 0xff;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v & 0xffff);
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v & 0xffffffff);
+}
+
+/// SplitMix64: small, fast, and good enough for made-up counters.
+static uint64_t rng_next(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+/// Random number in [0, n). n must be non-zero.
+static uint32_t rng_range(uint64_t *state, uint32_t n)
+{
+	return (uint32_t)(((rng_next(state) >> 32) * n) >> 32);
+}
+
+/**
+ * Turn an image number into a serial number.
+ *
+ * This is a bijection on 32-bit values, so serial numbers are unique across
+ * the first 2^32 images from a seed, without having to remember the ones
+ * already used.
+ */
+static uint32_t make_serial(uint64_t seed, uint64_t n)
+{
+	// Mix the whole seed in, so nearby seeds don't give the same serial numbers
+	uint64_t key = seed;
+	key = rng_next(&key);
+
+	uint32_t x = (uint32_t)n ^ (uint32_t)key;
+	x ^= x >> 16;
+	x *= 0x7FEB352DU;
+	x ^= x >> 15;
+	x *= 0x846CA68BU;
+	x ^= x >> 16;
+	return x + (uint32_t)(key >> 32);
+}
+
+/// Copy an ASCII field, padding it with spaces.
+static void put_ascii(uint8_t *p, const char *s, size_t len)
+{
+	size_t n = strlen(s);
+	memset(p, ' ', len);
+	memcpy(p, s, n < len ? n : len);
+}
+
+/// Write an 8-character YYYYMMDD date.
+static void put_date(uint8_t *p, uint64_t *rng, uint16_t firstYear, uint16_t years)
+{
+	// One draw per statement: the order of evaluation of arguments is unspecified
+	unsigned year = firstYear + rng_range(rng, years);
+	unsigned month = 1 + rng_range(rng, 12);
+	unsigned day = 1 + rng_range(rng, 28);
+
+	char date[16];
+	snprintf(date, sizeof(date), "%04u%02u%02u", year, month, day);
+	memcpy(p, date, 8);
+}
+
+
+/***
+ * Image generation
+ ***/
+
+/// Image being built: pages are added one after another, each listed in the page table
+typedef struct {
+	uint8_t *image;
+	size_t length;
+	size_t nextPage;			///< Offset of the next page
+	size_t numPages;
+} image_builder;
+
+/**
+ * Add a page to the image, and to the page table.
+ *
+ * Exits if the page, or its page table entry, doesn't fit: that is a bug in
+ * the layout, not something to paper over by writing a short image.
+ *
+ * @param	id			Page ID.
+ * @param	length		Page length, including the 4-byte header. Rounded up to whole blocks.
+ * @return	Pointer to the page header.
+ */
+static uint8_t *add_page(image_builder *b, uint16_t id, size_t length)
+{
+	length = (length + 31) & ~(size_t)31;
+
+	// Leave room in the page table for this entry and the terminator
+	if ((b->nextPage + length > b->length) || (32 + (b->numPages + 2) * 4 > FIRST_PAGE_OFFSET)) {
+		fprintf(stderr, "Error: page %03X doesn't fit in a %zu-byte image\n", id, b->length);
+		exit(EXIT_FAILURE);
+	}
+
+	uint8_t *page = &b->image[b->nextPage];
+	put_be16(&page[0], id);
+	put_be16(&page[2], length);
+
+	// Page table starts in Block 1
+	uint8_t *entry = &b->image[32 + b->numPages * 4];
+	put_be16(&entry[0], id);
+	put_be16(&entry[2], b->nextPage);
+
+	b->nextPage += length;
+	b->numPages++;
+	return page;
+}
+
+/**
+ * Generate one image.
+ *
+ * @param	seed		Corpus seed.
+ * @param	n			Image number.
+ * @param	ltocmType	LTO-CM type 1-3, or 0 for a realistic mix.
+ * @param	image		Returns the image; LTOCM_MAX_IMAGE bytes.
+ * @param	serialNum	Returns the 5-byte serial number.
+ * @param	ltoStandard	Returns the 2-byte REQUEST STANDARD response.
+ * @return	Image length in bytes.
+ */
+static size_t generate_image(uint64_t seed, uint64_t n, int ltocmType,
+		uint8_t *image, uint8_t *serialNum, uint8_t *ltoStandard)
+{
+	// Each image has its own random stream, so image n doesn't depend on images 0..n-1
+	uint64_t rng = seed ^ (n * 0xD1B54A32D192ED03ULL);
+	rng_next(&rng);
+
+	// Pick a generation, by weight, until we get one with the right LTO-CM type
+	const lto_generation *gen;
+	do {
+		uint32_t r = rng_range(&rng, 100);
+		size_t i = 0;
+		while ((i < NUM_GENERATIONS - 1) && (r >= generations[i].weight)) {
+			r -= generations[i].weight;
+			i++;
+		}
+		gen = &generations[i];
+	} while ((ltocmType != 0) && (gen->ltocmType != ltocmType));
+
+	size_t numBlocks = (gen->ltocmType == 1) ? 127 : (gen->ltocmType == 2) ? 255 : 511;
+	size_t length = numBlocks * 32;
+	memset(image, 0, length);
+
+	image_builder b = { image, length, FIRST_PAGE_OFFSET, 0 };
+
+	// Block 0: LTO-CM Manufacturer's Information
+	uint32_t serial = make_serial(seed, n);
+	put_be32(&image[0], serial);
+	image[4] = image[0] ^ image[1] ^ image[2] ^ image[3];
+	put_be16(&image[6], gen->ltocmType);
+	put_be16(&image[8], (uint16_t)(((numBlocks + 1) * 32) / 1024));	// capacity in KiB
+
+	memcpy(serialNum, image, 5);
+	memcpy(ltoStandard, &image[6], 2);
+
+	uint16_t mfrYears = 2 + rng_range(&rng, 4);
+	char text[16];
+
+	// Cartridge Manufacturer's Information
+	uint8_t *page = add_page(&b, PAGE_CARTRIDGE_MFR, 64);
+	put_ascii(&page[4], cartridgeMfrs[rng_range(&rng, NUM_CARTRIDGE_MFRS)], 8);
+	snprintf(text, sizeof(text), "Z%09u", (unsigned)(serial % 1000000000U));
+	put_ascii(&page[12], text, 10);
+	put_be16(&page[22], gen->generation);
+	put_date(&page[24], &rng, gen->firstYear, mfrYears);
+	put_be16(&page[32], gen->tapeLength);
+
+	// Media Manufacturer's Information
+	page = add_page(&b, PAGE_MEDIA_MFR, 64);
+	put_ascii(&page[4], cartridgeMfrs[rng_range(&rng, NUM_CARTRIDGE_MFRS)], 8);
+	put_date(&page[12], &rng, gen->firstYear, mfrYears);
+
+	// Initialisation Data
+	page = add_page(&b, PAGE_INIT_DATA, 64);
+	page[4] = gen->densityCode;
+	put_be16(&page[6], gen->wraps);
+
+	// Usage history: how often the tape has been loaded, and how much it's been used
+	// Random draws each get their own statement, so the output doesn't depend
+	// on the order the compiler evaluates operands in
+	uint32_t threadsBase = 1 + rng_range(&rng, 50);
+	uint32_t threadsScale = 1 + rng_range(&rng, 40);
+	uint32_t threads = threadsBase * threadsScale;
+	uint32_t fullPasses = rng_range(&rng, 1 + threads / 4);
+	uint16_t eodWrap = rng_range(&rng, gen->wraps);
+	uint64_t totalMBWritten = (uint64_t)fullPasses * gen->capacityMB +
+		((uint64_t)gen->capacityMB * (eodWrap + 1)) / gen->wraps;
+	uint32_t readDivisor = 1 + rng_range(&rng, 4);
+	uint32_t readMultiplier = 1 + rng_range(&rng, 3);
+	uint64_t totalMBRead = totalMBWritten / readDivisor * readMultiplier;
+
+	// Tape Write Pass: current write pass, then the write pass that last wrote each wrap.
+	// Appends bump the write pass, so it never goes down along the tape.
+	page = add_page(&b, PAGE_TAPE_WRITE_PASS, 8 + gen->wraps * 4);
+	uint32_t writePass = 1 + fullPasses + rng_range(&rng, 1 + threads);
+	uint32_t wrapPass = writePass - rng_range(&rng, MIN(writePass, 1U + eodWrap / 4));
+	for (uint16_t w = 0; w <= eodWrap; w++) {
+		if ((w > 0) && (rng_range(&rng, 8) == 0) && (wrapPass < writePass))
+			wrapPass++;
+		put_be32(&page[8 + w * 4], (w == eodWrap) ? writePass : wrapPass);
+	}
+	put_be32(&page[4], writePass);
+
+	// Tape Directory: records and filemarks on each wrap, up to EOD
+	page = add_page(&b, PAGE_TAPE_DIRECTORY, 4 + gen->wraps * 8);
+	uint64_t totalRecords = 0, totalFilemarks = 0;
+	uint32_t recordsPerWrap = (uint32_t)(((uint64_t)gen->capacityMB * 4) / gen->wraps);
+	for (uint16_t w = 0; w <= eodWrap; w++) {
+		uint32_t records = recordsPerWrap / 2 + rng_range(&rng, recordsPerWrap);
+		uint32_t filemarks = rng_range(&rng, 64);
+		if (w == eodWrap)
+			records = rng_range(&rng, 1 + records);
+		put_be32(&page[4 + w * 8], records);
+		put_be32(&page[8 + w * 8], filemarks);
+		totalRecords += records;
+		totalFilemarks += filemarks;
+	}
+
+	// EOD Information
+	page = add_page(&b, PAGE_EOD_INFO, 64);
+	put_be32(&page[4], writePass);
+	put_be16(&page[8], eodWrap);
+	put_be64(&page[12], totalRecords + totalFilemarks);
+	put_be64(&page[20], totalRecords);
+	put_be64(&page[28], totalFilemarks);
+
+	// Cartridge Status and Tape Alert Flags: an occasional worn or dirty tape
+	page = add_page(&b, PAGE_CARTRIDGE_STATUS, 32);
+	page[4] = (rng_range(&rng, 50) == 0) ? 0x01 : 0x00;
+	if (rng_range(&rng, 20) == 0) {
+		uint32_t alertByte = rng_range(&rng, 8);
+		uint32_t alertBit = rng_range(&rng, 8);
+		page[8 + alertByte] = 1 << alertBit;
+	}
+
+	add_page(&b, PAGE_MECHANISM, 64);
+	add_page(&b, PAGE_SUSPENDED_WRITES, 32);
+
+	// Usage Information: one page per recently used drive, oldest first.
+	// Counters are cumulative, so each page is no smaller than the one before.
+	uint32_t drives = 1 + rng_range(&rng, NUM_USAGE_PAGES);
+	for (uint32_t d = 0; d < NUM_USAGE_PAGES; d++) {
+		page = add_page(&b, PAGE_USAGE_INFO_0 + d, 80);
+		if (d >= drives)
+			continue;
+
+		uint32_t share = drives - d;
+		put_ascii(&page[4], driveMfrs[rng_range(&rng, NUM_DRIVE_MFRS)], 8);
+		snprintf(text, sizeof(text), "%010llu", (unsigned long long)(rng_next(&rng) % 10000000000ULL));
+		put_ascii(&page[12], text, 10);
+		put_be32(&page[24], threads / share);
+		put_be64(&page[28], totalRecords / share);
+		put_be64(&page[36], (totalRecords / 2) / share);
+		put_be64(&page[44], totalMBWritten / share);
+		put_be64(&page[52], totalMBRead / share);
+		put_be32(&page[60], rng_range(&rng, 1 + threads / share));
+		put_be32(&page[64], rng_range(&rng, 1 + threads / share));
+		put_be16(&page[68], (rng_range(&rng, 100) == 0) ? 1 : 0);
+		put_be16(&page[70], (rng_range(&rng, 100) == 0) ? 1 : 0);
+	}
+
+	// Application Specific: volume barcode, e.g. "A00042L6"
+	page = add_page(&b, PAGE_APPLICATION, 64);
+	snprintf(text, sizeof(text), "%c%05uL%d", 'A' + (int)((n / 100000) % 26), (unsigned)(n % 100000), gen->generation);
+	put_ascii(&page[4], text, 8);
+
+	// End of the page table
+	uint8_t *entry = &image[32 + b.numPages * 4];
+	put_be16(&entry[0], PAGE_END);
+	put_be16(&entry[2], b.nextPage);
+
+	return length;
+}
+
+
+/***
+ * Main
+ ***/
+
+/// Parse a whole unsigned number (decimal, or hex with 0x).
+static bool parse_u64(const char *s, uint64_t *value)
+{
+	char *end;
+
+	// strtoull() would quietly negate a leading minus sign
+	if (!isdigit((unsigned char)s[0]))
+		return false;
+
+	errno = 0;
+	*value = strtoull(s, &end, 0);
+	return (errno == 0) && (*end == '\0');
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-n count] [-s seed] [-f first] [-t type] [-o dir | -p packfile]\n", progname);
+	fprintf(stderr, "  -n count     Number of images (default 1000)\n");
+	fprintf(stderr, "  -s seed      Corpus seed (default 1)\n");
+	fprintf(stderr, "  -f first     Number of the first image, to split a corpus into chunks (default 0)\n");
+	fprintf(stderr, "  -t type      LTO-CM type 1, 2 or 3 (default: a mix)\n");
+	fprintf(stderr, "  -o dir       Write one .bin file per image into dir\n");
+	fprintf(stderr, "  -p packfile  Append images to a pack file\n");
+	fprintf(stderr, "With neither -o nor -p, images are written back-to-back to stdout. There is no\n");
+	fprintf(stderr, "framing: the LTO-CM type in Block 0 bytes 6:7 (big-endian) gives each image's\n");
+	fprintf(stderr, "length, 127, 255 or 511 blocks of 32 bytes for types 1, 2 and 3.\n");
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t count = 1000;
+	uint64_t seed = 1;
+	uint64_t first = 0;
+	uint64_t type;
+	int ltocmType = 0;
+	const char *dir = NULL;
+	const char *packname = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:f:t:o:p:")) != -1) {
+		switch (opt) {
+			case 'n':
+				if (!parse_u64(optarg, &count)) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 's':
+				if (!parse_u64(optarg, &seed)) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 'f':
+				if (!parse_u64(optarg, &first)) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			case 't':
+				if (!parse_u64(optarg, &type) || type < 1 || type > 3) {
+					usage(argv[0]);
+					exit(EXIT_FAILURE);
+				}
+				ltocmType = type;
+				break;
+			case 'o':
+				dir = optarg;
+				break;
+			case 'p':
+				packname = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+	if ((optind != argc) || (dir && packname)) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!dir && !packname && isatty(STDOUT_FILENO)) {
+		printf("Error: not writing binary images to a terminal, use -o, -p or a redirect\n");
+		exit(EXIT_FAILURE);
+	}
+
+	ltocm_pack_writer writer;
+	if (packname && !ltocm_pack_writer_open(&writer, packname)) {
+		printf("Error: cannot open pack file '%s'\n", packname);
+		exit(EXIT_FAILURE);
+	}
+
+	static uint8_t image[LTOCM_MAX_IMAGE];
+	static char stdoutBuf[1024 * 1024];
+	if (!dir && !packname)
+		setvbuf(stdout, stdoutBuf, _IOFBF, sizeof(stdoutBuf));
+
+	int returncode = EXIT_SUCCESS;
+	uint8_t serialNum[5];
+	uint8_t ltoStandard[2];
+
+	for (uint64_t n = first; n < first + count; n++) {
+		size_t length = generate_image(seed, n, ltocmType, image, serialNum, ltoStandard);
+
+		if (packname) {
+			if (!ltocm_pack_writer_add(&writer, serialNum, ltoStandard, image, length)) {
+				printf("Error: failed writing pack file '%s'\n", packname);
+				returncode = EXIT_FAILURE;
+				break;
+			}
+		} else if (dir) {
+			char filename[4096];
+			snprintf(filename, sizeof(filename), "%s/%02X%02X%02X%02X.bin",
+					dir, serialNum[0], serialNum[1], serialNum[2], serialNum[3]);
+
+			FILE *fp = fopen(filename, "wb");
+			if (!fp) {
+				printf("Error: cannot open output file '%s'\n", filename);
+				returncode = EXIT_FAILURE;
+				break;
+			}
+			bool written = (fwrite(image, 1, length, fp) == length);
+			if ((fclose(fp) != 0) || !written) {
+				printf("Error: failed writing output file '%s'\n", filename);
+				returncode = EXIT_FAILURE;
+				break;
+			}
+		} else if (fwrite(image, 1, length, stdout) != length) {
+			fprintf(stderr, "Error: failed writing to stdout\n");
+			returncode = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	if (packname && !ltocm_pack_writer_close(&writer)) {
+		printf("Error: failed writing pack file '%s'\n", packname);
+		returncode = EXIT_FAILURE;
+	}
+	if (!dir && !packname && fflush(stdout) != 0) {
+		fprintf(stderr, "Error: failed writing to stdout\n");
+		returncode = EXIT_FAILURE;
+	}
+
+	exit(returncode);
+}
@@ -0,0 +1,549 @@
+/***
+ * ltocm-pack: LTO-CM image pack files
+ *
+ * Phil Pemberton <philpem@philpem.me.uk>
+ * github.com/philpem
+ * www.philpem.me.uk
+ *
+ * Licence: 2-clause BSD, see README.md
+ *
+ * See ltocm-pack.h for a description of the file format.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "nfc-ltocm.h"
+#include "ltocm-pack.h"
+
+
+/// Pack format version
+#define LTOCM_PACK_VERSION	1
+
+/// File header magic
+static const uint8_t PACK_MAGIC_FILE[8]		= { 'L', 'T', 'O', 'C', 'M', 'P', 'A', 'K' };
+
+/// Record header magic
+static const uint8_t PACK_MAGIC_RECORD[8]	= { 'L', 'T', 'O', 'C', 'M', 'R', 'E', 'C' };
+
+/// Footer magic
+static const uint8_t PACK_MAGIC_FOOTER[8]	= { 'L', 'T', 'O', 'C', 'M', 'I', 'D', 'X' };
+
+
+/***
+ * Utility functions
+ ***/
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v & 0xffff);
+	put_le16(p + 2, v >> 16);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+	put_le32(p, v & 0xffffffff);
+	put_le32(p + 4, v >> 32);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+	return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+static uint64_t align_up(uint64_t v)
+{
+	return (v + LTOCM_PACK_ALIGN - 1) & ~(uint64_t)(LTOCM_PACK_ALIGN - 1);
+}
+
+/**
+ * Check that an image length is one a pack can hold.
+ *
+ * Images must be a whole number of 32-byte blocks, so that a record header
+ * plus the image never overlaps the next aligned record.
+ */
+static bool valid_length(uint64_t length)
+{
+	return (length > 0) && (length <= LTOCM_MAX_IMAGE) && ((length % 32) == 0);
+}
+
+/// Write a buffer at a file offset, retrying short writes.
+static bool pwrite_all(int fd, const uint8_t *buf, size_t len, uint64_t offset)
+{
+	while (len > 0) {
+		ssize_t n = pwrite(fd, buf, len, (off_t)offset);
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/// Read a buffer from a file offset. Fails on short reads.
+static bool pread_all(int fd, uint8_t *buf, size_t len, uint64_t offset)
+{
+	while (len > 0) {
+		ssize_t n = pread(fd, buf, len, (off_t)offset);
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return true;
+}
+
+/**
+ * Lock a pack file, saying so if another program holds it.
+ *
+ * Writers can keep a pack locked for a long time (ltocm-gen, or nfc-ltocm
+ * waiting for a tag), so don't block without telling the user why.
+ *
+ * @param	fd			Open pack file.
+ * @param	operation	LOCK_SH or LOCK_EX.
+ * @param	path		Pack file name, for the message.
+ */
+static bool lock_pack(int fd, int operation, const char *path)
+{
+	if (flock(fd, operation | LOCK_NB) == 0)
+		return true;
+	if (errno != EWOULDBLOCK)
+		return false;
+
+	fprintf(stderr, "Pack file '%s' is in use by another program, waiting...\n", path);
+	while (flock(fd, operation) != 0) {
+		if (errno != EINTR)
+			return false;
+	}
+	return true;
+}
+
+static bool check_file_header(const uint8_t *hdr)
+{
+	return (memcmp(hdr, PACK_MAGIC_FILE, sizeof(PACK_MAGIC_FILE)) == 0) &&
+		(get_le32(&hdr[8]) == LTOCM_PACK_VERSION) &&
+		(get_le32(&hdr[12]) == LTOCM_PACK_ALIGN);
+}
+
+/**
+ * Check a footer against the size of the file it was read from.
+ *
+ * @param	ftr			Footer bytes.
+ * @param	size		File size in bytes.
+ * @param	indexOffset	Returns the file offset of the index.
+ * @param	count		Returns the number of index entries.
+ */
+static bool check_footer(const uint8_t *ftr, uint64_t size, uint64_t *indexOffset, uint64_t *count)
+{
+	if (memcmp(ftr, PACK_MAGIC_FOOTER, sizeof(PACK_MAGIC_FOOTER)) != 0)
+		return false;
+	if (get_le32(&ftr[8]) != LTOCM_PACK_VERSION)
+		return false;
+
+	*indexOffset = get_le64(&ftr[16]);
+	*count = get_le64(&ftr[24]);
+
+	// The index must start after the file header and run right up to the footer
+	if (*indexOffset < LTOCM_PACK_ALIGN || *indexOffset > size)
+		return false;
+	if (*count > (size - *indexOffset) / LTOCM_PACK_ENTRY_LEN)
+		return false;
+	return (*indexOffset + (*count * LTOCM_PACK_ENTRY_LEN) + LTOCM_PACK_HDR_LEN) == size;
+}
+
+static void decode_entry(const uint8_t *p, ltocm_pack_entry *entry)
+{
+	memcpy(entry->serialNum, &p[0], 4);
+	memcpy(entry->ltoStandard, &p[4], 2);
+	entry->length = get_le32(&p[8]);
+	entry->offset = get_le64(&p[16]);
+	entry->data = NULL;
+}
+
+/// Order index entries by serial number, then by position in the file.
+static int compare_entries(const void *a, const void *b)
+{
+	const uint8_t *ea = a, *eb = b;
+	int r = memcmp(ea, eb, 4);
+	if (r != 0)
+		return r;
+
+	uint64_t oa = get_le64(&ea[16]), ob = get_le64(&eb[16]);
+	return (oa > ob) - (oa < ob);
+}
+
+
+/***
+ * Reading
+ ***/
+
+/**
+ * Open a pack file for reading.
+ *
+ * The file is mapped into memory; images returned by ltocm_pack_get() and
+ * ltocm_pack_find() point into the mapping and stay valid until the pack is
+ * closed. Waits for any writer to finish, and holds off writers until closed.
+ *
+ * @param	pack		Pack handle to initialise.
+ * @param	path		Pack file name.
+ * @return	false if the file can't be opened or has no valid index.
+ */
+bool ltocm_pack_open(ltocm_pack *pack, const char *path)
+{
+	struct stat st;
+	uint64_t indexOffset, count;
+
+	memset(pack, 0, sizeof(*pack));
+
+	pack->fd = open(path, O_RDONLY);
+	if (pack->fd < 0)
+		return false;
+
+	// Keep writers out while the pack is mapped: they truncate the file
+	if (!lock_pack(pack->fd, LOCK_SH, path))
+		goto err_close;
+
+	if (fstat(pack->fd, &st) != 0 || st.st_size < LTOCM_PACK_ALIGN + LTOCM_PACK_HDR_LEN)
+		goto err_close;
+
+	// The whole pack is mapped, so it has to fit in the address space
+	if ((off_t)(size_t)st.st_size != st.st_size)
+		goto err_close;
+
+	pack->size = st.st_size;
+	void *map = mmap(NULL, pack->size, PROT_READ, MAP_SHARED, pack->fd, 0);
+	if (map == MAP_FAILED)
+		goto err_close;
+	pack->map = map;
+
+	if (!check_file_header(pack->map) ||
+			!check_footer(&pack->map[pack->size - LTOCM_PACK_HDR_LEN], pack->size, &indexOffset, &count)) {
+		ltocm_pack_close(pack);
+		return false;
+	}
+
+	pack->index = &pack->map[indexOffset];
+	pack->count = count;
+	return true;
+
+err_close:
+	close(pack->fd);
+	pack->fd = -1;
+	return false;
+}
+
+void ltocm_pack_close(ltocm_pack *pack)
+{
+	if (pack->map != NULL)
+		munmap((void *)pack->map, pack->size);
+	if (pack->fd >= 0)
+		close(pack->fd);
+
+	pack->map = NULL;
+	pack->index = NULL;
+	pack->count = 0;
+	pack->fd = -1;
+}
+
+/**
+ * Fetch an index entry by position in the index.
+ *
+ * @param	pack		Open pack.
+ * @param	n			Index position, 0 to pack->count-1.
+ * @param	entry		Returns the entry.
+ * @return	false if n is out of range, or the entry points outside the file.
+ */
+bool ltocm_pack_get(const ltocm_pack *pack, size_t n, ltocm_pack_entry *entry)
+{
+	if (n >= pack->count)
+		return false;
+
+	decode_entry(&pack->index[n * LTOCM_PACK_ENTRY_LEN], entry);
+
+	// Images live between the file header and the index
+	uint64_t indexOffset = pack->index - pack->map;
+	if (!valid_length(entry->length) || entry->offset < LTOCM_PACK_ALIGN ||
+			entry->offset > indexOffset || entry->length > indexOffset - entry->offset)
+		return false;
+
+	entry->data = &pack->map[entry->offset];
+	return true;
+}
+
+/**
+ * Find the most recent image of a cartridge.
+ *
+ * Binary search of the index, so lookups are O(log n) and only touch the
+ * pages of the index they need.
+ *
+ * @param	pack		Open pack.
+ * @param	serialNum	4-byte LTO-CM serial number.
+ * @param	entry		Returns the entry.
+ * @return	false if the serial number is not in the pack.
+ */
+bool ltocm_pack_find(const ltocm_pack *pack, const uint8_t *serialNum, ltocm_pack_entry *entry)
+{
+	// Find the first entry with a greater serial number
+	size_t lo = 0, hi = pack->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (memcmp(&pack->index[mid * LTOCM_PACK_ENTRY_LEN], serialNum, 4) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// Entries with the same serial are in file order, so the one before is the newest
+	if (lo == 0 || memcmp(&pack->index[(lo - 1) * LTOCM_PACK_ENTRY_LEN], serialNum, 4) != 0)
+		return false;
+
+	return ltocm_pack_get(pack, lo - 1, entry);
+}
+
+
+/***
+ * Writing
+ ***/
+
+static bool writer_append_entry(ltocm_pack_writer *writer, const uint8_t *serialNum,
+		const uint8_t *ltoStandard, uint32_t length, uint64_t offset)
+{
+	if (writer->count == writer->alloc) {
+		size_t alloc = writer->alloc ? writer->alloc * 2 : 1024;
+		uint8_t *index = realloc(writer->index, alloc * LTOCM_PACK_ENTRY_LEN);
+		if (index == NULL)
+			return false;
+		writer->index = index;
+		writer->alloc = alloc;
+	}
+
+	uint8_t *p = &writer->index[writer->count * LTOCM_PACK_ENTRY_LEN];
+	memset(p, 0, LTOCM_PACK_ENTRY_LEN);
+	memcpy(&p[0], serialNum, 4);
+	memcpy(&p[4], ltoStandard, 2);
+	put_le32(&p[8], length);
+	put_le64(&p[16], offset);
+	writer->count++;
+	return true;
+}
+
+/// Load the index of an existing pack, using the footer.
+static bool writer_load_index(ltocm_pack_writer *writer, uint64_t size)
+{
+	uint8_t ftr[LTOCM_PACK_HDR_LEN];
+	uint64_t indexOffset, count;
+
+	if (size < LTOCM_PACK_ALIGN + LTOCM_PACK_HDR_LEN)
+		return false;
+	if (!pread_all(writer->fd, ftr, sizeof(ftr), size - LTOCM_PACK_HDR_LEN))
+		return false;
+	if (!check_footer(ftr, size, &indexOffset, &count))
+		return false;
+
+	if (count > 0) {
+		writer->index = malloc(count * LTOCM_PACK_ENTRY_LEN);
+		if (writer->index == NULL)
+			return false;
+		writer->alloc = count;
+		if (!pread_all(writer->fd, writer->index, count * LTOCM_PACK_ENTRY_LEN, indexOffset))
+			return false;
+	}
+
+	writer->count = count;
+	writer->dataEnd = indexOffset;
+	return true;
+}
+
+/// Rebuild the index of a pack by walking its record headers.
+static bool writer_scan_records(ltocm_pack_writer *writer, uint64_t size)
+{
+	uint8_t rec[LTOCM_PACK_HDR_LEN];
+	uint64_t offset = LTOCM_PACK_ALIGN;
+
+	writer->count = 0;
+
+	while (offset + LTOCM_PACK_HDR_LEN <= size) {
+		if (!pread_all(writer->fd, rec, sizeof(rec), offset))
+			return false;
+		if (memcmp(rec, PACK_MAGIC_RECORD, sizeof(PACK_MAGIC_RECORD)) != 0)
+			break;
+
+		// A record cut short by a crash ends the scan, and is overwritten
+		uint32_t length = get_le32(&rec[16]);
+		if (!valid_length(length) || offset + LTOCM_PACK_HDR_LEN + length > size)
+			break;
+
+		if (!writer_append_entry(writer, &rec[8], &rec[12], length, offset + LTOCM_PACK_HDR_LEN))
+			return false;
+		offset = align_up(offset + LTOCM_PACK_HDR_LEN + length);
+	}
+
+	writer->dataEnd = offset;
+	return true;
+}
+
+/**
+ * Open a pack file for appending, creating it if it doesn't exist.
+ *
+ * The existing index is read into memory and cut off the end of the file, so
+ * new records can be written in its place. If the index is missing or damaged
+ * (e.g. a previous writer was interrupted), it is rebuilt from the record
+ * headers.
+ *
+ * The pack is locked until ltocm_pack_writer_close(), so other writers and
+ * readers wait for the new index to be written.
+ *
+ * @param	writer		Writer handle to initialise.
+ * @param	path		Pack file name.
+ * @return	false if the file can't be opened, or is not a pack file.
+ */
+bool ltocm_pack_writer_open(ltocm_pack_writer *writer, const char *path)
+{
+	struct stat st;
+	uint8_t hdr[LTOCM_PACK_HDR_LEN];
+
+	memset(writer, 0, sizeof(*writer));
+
+	writer->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (writer->fd < 0)
+		return false;
+
+	// Only one writer at a time, and no readers; released when the fd is closed
+	if (!lock_pack(writer->fd, LOCK_EX, path))
+		goto err_close;
+
+	if (fstat(writer->fd, &st) != 0)
+		goto err_close;
+
+	if (st.st_size == 0) {
+		// New pack: the first record goes after the padded file header
+		memset(hdr, 0, sizeof(hdr));
+		memcpy(hdr, PACK_MAGIC_FILE, sizeof(PACK_MAGIC_FILE));
+		put_le32(&hdr[8], LTOCM_PACK_VERSION);
+		put_le32(&hdr[12], LTOCM_PACK_ALIGN);
+		if (!pwrite_all(writer->fd, hdr, sizeof(hdr), 0))
+			goto err_close;
+		writer->dataEnd = LTOCM_PACK_ALIGN;
+		return true;
+	}
+
+	if (!pread_all(writer->fd, hdr, sizeof(hdr), 0) || !check_file_header(hdr))
+		goto err_close;
+
+	if (!writer_load_index(writer, st.st_size)) {
+		free(writer->index);
+		writer->index = NULL;
+		writer->alloc = 0;
+		if (!writer_scan_records(writer, st.st_size))
+			goto err_close;
+	}
+
+	// Drop the old index, so a crash before close leaves no stale footer behind
+	if (ftruncate(writer->fd, (off_t)writer->dataEnd) != 0)
+		goto err_close;
+
+	return true;
+
+err_close:
+	free(writer->index);
+	writer->index = NULL;
+	close(writer->fd);
+	writer->fd = -1;
+	return false;
+}
+
+/**
+ * Append an image to a pack.
+ *
+ * @param	writer		Open writer.
+ * @param	serialNum	4-byte LTO-CM serial number.
+ * @param	ltoStandard	2-byte REQUEST STANDARD response.
+ * @param	image		Image data.
+ * @param	length		Image length in bytes; a multiple of 32, at most LTOCM_MAX_IMAGE.
+ */
+bool ltocm_pack_writer_add(ltocm_pack_writer *writer, const uint8_t *serialNum,
+		const uint8_t *ltoStandard, const uint8_t *image, size_t length)
+{
+	uint8_t rec[LTOCM_PACK_HDR_LEN];
+
+	if (!valid_length(length))
+		return false;
+
+	memset(rec, 0, sizeof(rec));
+	memcpy(rec, PACK_MAGIC_RECORD, sizeof(PACK_MAGIC_RECORD));
+	memcpy(&rec[8], serialNum, 4);
+	memcpy(&rec[12], ltoStandard, 2);
+	put_le32(&rec[16], length);
+
+	uint64_t offset = writer->dataEnd;
+	if (!pwrite_all(writer->fd, rec, sizeof(rec), offset) ||
+			!pwrite_all(writer->fd, image, length, offset + LTOCM_PACK_HDR_LEN))
+		return false;
+
+	if (!writer_append_entry(writer, serialNum, ltoStandard, length, offset + LTOCM_PACK_HDR_LEN))
+		return false;
+
+	writer->dataEnd = align_up(offset + LTOCM_PACK_HDR_LEN + length);
+	return true;
+}
+
+/**
+ * Sort and write the index and footer, then close the pack.
+ *
+ * The writer is released even if writing fails.
+ */
+bool ltocm_pack_writer_close(ltocm_pack_writer *writer)
+{
+	uint8_t ftr[LTOCM_PACK_HDR_LEN];
+	bool ok = true;
+
+	qsort(writer->index, writer->count, LTOCM_PACK_ENTRY_LEN, compare_entries);
+
+	memset(ftr, 0, sizeof(ftr));
+	memcpy(ftr, PACK_MAGIC_FOOTER, sizeof(PACK_MAGIC_FOOTER));
+	put_le32(&ftr[8], LTOCM_PACK_VERSION);
+	put_le64(&ftr[16], writer->dataEnd);
+	put_le64(&ftr[24], writer->count);
+
+	uint64_t indexLen = (uint64_t)writer->count * LTOCM_PACK_ENTRY_LEN;
+	if (!pwrite_all(writer->fd, writer->index, indexLen, writer->dataEnd) ||
+			!pwrite_all(writer->fd, ftr, sizeof(ftr), writer->dataEnd + indexLen) ||
+			ftruncate(writer->fd, (off_t)(writer->dataEnd + indexLen + sizeof(ftr))) != 0 ||
+			fsync(writer->fd) != 0)
+		ok = false;
+
+	if (close(writer->fd) != 0)
+		ok = false;
+
+	free(writer->index);
+	writer->index = NULL;
+	writer->count = writer->alloc = 0;
+	writer->fd = -1;
+	return ok;
+}
@@ -0,0 +1,110 @@
+/***
+ * ltocm-pack: LTO-CM image pack files
+ *
+ * Phil Pemberton <philpem@philpem.me.uk>
+ * github.com/philpem
+ * www.philpem.me.uk
+ *
+ * Licence: 2-clause BSD, see README.md
+ *
+ * A pack file holds many LTO-CM images back-to-back, followed by an index
+ * sorted by serial number. All integers are little-endian.
+ *
+ *   File header      32 bytes, padded with zeroes to LTOCM_PACK_ALIGN
+ *   Records          one per image, each starting on an LTOCM_PACK_ALIGN
+ *                    boundary: a 32-byte record header then the image
+ *   Index            LTOCM_PACK_ENTRY_LEN bytes per image, sorted by serial
+ *                    number, then by position in the file
+ *   Footer           32 bytes, always the last thing in the file
+ *
+ * LTO-CM images are 32 bytes short of a multiple of 4KiB (127, 255 or 511
+ * blocks of 32 bytes), so a record header plus its image fills a whole number
+ * of 4KiB pages with no padding, and every image starts on a block boundary.
+ *
+ * The record headers duplicate the index, which lets a pack be recovered if
+ * the program writing it dies before the index is written.
+ *
+ * Layouts (byte offsets; fields not listed are reserved, and written as zero):
+ *
+ *   File header (at 0, 32 bytes)
+ *     0-7    magic "LTOCMPAK"
+ *     8-11   format version (1)
+ *     12-15  record alignment (4096)
+ *
+ *   Record header (32 bytes, image data follows immediately)
+ *     0-7    magic "LTOCMREC"
+ *     8-11   LTO-CM serial number (without check byte)
+ *     12-13  REQUEST STANDARD response (Block 0 bytes 6:7)
+ *     16-19  image length in bytes
+ *
+ *   Index entry (24 bytes)
+ *     0-3    LTO-CM serial number (without check byte)
+ *     4-5    REQUEST STANDARD response
+ *     8-11   image length in bytes
+ *     16-23  file offset of the image data (just after its record header)
+ *
+ *   Footer (last 32 bytes of the file)
+ *     0-7    magic "LTOCMIDX"
+ *     8-11   format version (1)
+ *     16-23  file offset of the index
+ *     24-31  number of index entries
+ *
+ * Index entries compare serial numbers bytewise, so the order is the same as
+ * the order of the hex serial numbers nfc-ltocm prints.
+ *
+ * Writers hold an exclusive flock() on the pack, and readers a shared one,
+ * so several programs can append to the same pack safely.
+ *
+ * Readers map the whole pack, so a pack can only be read if it fits in the
+ * process's address space: on a 32-bit host that is a couple of GiB at most.
+ * Writers don't map the pack, and can append past that.
+ */
+#ifndef LTOCM_PACK_H__
+#define LTOCM_PACK_H__
+
+/// Record alignment within a pack file
+#define LTOCM_PACK_ALIGN		4096
+
+/// Length of a file header, record header or footer
+#define LTOCM_PACK_HDR_LEN		32
+
+/// Length of an index entry
+#define LTOCM_PACK_ENTRY_LEN	24
+
+/// A single image in a pack
+typedef struct {
+	uint8_t serialNum[4];		///< LTO-CM serial number (without check byte)
+	uint8_t ltoStandard[2];		///< REQUEST STANDARD response (Block 0 bytes 6:7)
+	uint32_t length;			///< Image length in bytes
+	uint64_t offset;			///< File offset of the image data
+	const uint8_t *data;		///< Image data (read-only, mapped), NULL for writers
+} ltocm_pack_entry;
+
+/// Pack file opened for reading
+typedef struct {
+	int fd;
+	const uint8_t *map;			///< Whole file, mapped read-only
+	size_t size;				///< File size in bytes
+	const uint8_t *index;		///< First index entry
+	size_t count;				///< Number of index entries
+} ltocm_pack;
+
+/// Pack file opened for appending
+typedef struct {
+	int fd;
+	uint64_t dataEnd;			///< End of the last record
+	uint8_t *index;				///< Index entries, in the order they were added
+	size_t count;				///< Number of index entries
+	size_t alloc;				///< Number of entries allocated
+} ltocm_pack_writer;
+
+bool ltocm_pack_open(ltocm_pack *pack, const char *path);
+void ltocm_pack_close(ltocm_pack *pack);
+bool ltocm_pack_get(const ltocm_pack *pack, size_t n, ltocm_pack_entry *entry);
+bool ltocm_pack_find(const ltocm_pack *pack, const uint8_t *serialNum, ltocm_pack_entry *entry);
+
+bool ltocm_pack_writer_open(ltocm_pack_writer *writer, const char *path);
+bool ltocm_pack_writer_add(ltocm_pack_writer *writer, const uint8_t *serialNum,
+		const uint8_t *ltoStandard, const uint8_t *image, size_t length);
+bool ltocm_pack_writer_close(ltocm_pack_writer *writer);
+#endif
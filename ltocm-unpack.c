@@ -0,0 +1,167 @@
+/***
+ * ltocm-unpack: List and extract LTO-CM images from a pack file
+ *
+ * Phil Pemberton <philpem@philpem.me.uk>
+ * github.com/philpem
+ * www.philpem.me.uk
+ *
+ * Licence: 2-clause BSD, see README.md
+ *
+ * Extracted images are written as %02X%02X%02X%02X.bin, the same name
+ * nfc-ltocm gives a single image, ready for LTO-CM-Analyzer.
+ */
+#define _POSIX_C_SOURCE 200809L
+#define _FILE_OFFSET_BITS 64
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <unistd.h>
+
+#include "ltocm-pack.h"
+
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-x] [-d dir] packfile [serial ...]\n", progname);
+	fprintf(stderr, "  -x       Extract images (default: list the index)\n");
+	fprintf(stderr, "  -d dir   Write extracted images into dir\n");
+	fprintf(stderr, "  serial   8 hex digits, e.g. 1A2B3C4D. Default: every cartridge.\n");
+	fprintf(stderr, "If a cartridge appears more than once, its newest image is used.\n");
+}
+
+/// Parse a serial number given as 8 hex digits.
+static bool parse_serial(const char *s, uint8_t *serialNum)
+{
+	if (strlen(s) != 8)
+		return false;
+
+	for (size_t i = 0; i < 8; i++) {
+		if (!isxdigit((unsigned char)s[i]))
+			return false;
+	}
+
+	for (size_t i = 0; i < 4; i++) {
+		char byte[3] = { s[i*2], s[i*2 + 1], '\0' };
+		serialNum[i] = strtoul(byte, NULL, 16);
+	}
+	return true;
+}
+
+static void print_entry(const ltocm_pack_entry *entry)
+{
+	printf("%02X%02X%02X%02X  type %02X%02X  %5u bytes  offset %llu\n",
+			entry->serialNum[0], entry->serialNum[1], entry->serialNum[2], entry->serialNum[3],
+			entry->ltoStandard[0], entry->ltoStandard[1],
+			(unsigned)entry->length, (unsigned long long)entry->offset);
+}
+
+static bool extract_entry(const ltocm_pack_entry *entry, const char *dir)
+{
+	char filename[4096];
+	snprintf(filename, sizeof(filename), "%s%s%02X%02X%02X%02X.bin",
+			dir ? dir : "", dir ? "/" : "",
+			entry->serialNum[0], entry->serialNum[1], entry->serialNum[2], entry->serialNum[3]);
+
+	FILE *fp = fopen(filename, "wb");
+	if (!fp) {
+		printf("Error: cannot open output file '%s'\n", filename);
+		return false;
+	}
+
+	bool ok = (fwrite(entry->data, 1, entry->length, fp) == entry->length);
+	if (fclose(fp) != 0)
+		ok = false;
+	if (!ok)
+		printf("Error: failed writing output file '%s'\n", filename);
+	return ok;
+}
+
+int main(int argc, char **argv)
+{
+	int returncode = EXIT_SUCCESS;
+	bool extract = false;
+	const char *dir = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "xd:")) != -1) {
+		switch (opt) {
+			case 'x':
+				extract = true;
+				break;
+			case 'd':
+				dir = optarg;
+				break;
+			default:
+				usage(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	ltocm_pack pack;
+	if (!ltocm_pack_open(&pack, argv[optind])) {
+		printf("Error: cannot open pack file '%s', or it has no index\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	ltocm_pack_entry entry;
+
+	if (optind + 1 < argc) {
+		// Look up the cartridges named on the command line
+		for (int i = optind + 1; i < argc; i++) {
+			uint8_t serialNum[4];
+			if (!parse_serial(argv[i], serialNum)) {
+				printf("Error: invalid serial number '%s'\n", argv[i]);
+				returncode = EXIT_FAILURE;
+				continue;
+			}
+			if (!ltocm_pack_find(&pack, serialNum, &entry)) {
+				printf("Error: serial number %s not found\n", argv[i]);
+				returncode = EXIT_FAILURE;
+				continue;
+			}
+
+			if (extract) {
+				if (!extract_entry(&entry, dir))
+					returncode = EXIT_FAILURE;
+			} else {
+				print_entry(&entry);
+			}
+		}
+	} else {
+		// Walk the whole index
+		for (size_t n = 0; n < pack.count; n++) {
+			if (!ltocm_pack_get(&pack, n, &entry)) {
+				printf("Error: index entry %zu is damaged\n", n);
+				returncode = EXIT_FAILURE;
+				continue;
+			}
+
+			if (!extract) {
+				print_entry(&entry);
+				continue;
+			}
+
+			// Entries for a cartridge are in file order: only extract the last (newest)
+			ltocm_pack_entry next;
+			if (ltocm_pack_get(&pack, n + 1, &next) && memcmp(next.serialNum, entry.serialNum, 4) == 0)
+				continue;
+
+			if (!extract_entry(&entry, dir))
+				returncode = EXIT_FAILURE;
+		}
+	}
+
+	ltocm_pack_close(&pack);
+	exit(returncode);
+}
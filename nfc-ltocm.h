@@ -1,10 +1,21 @@
 #ifndef NFC_LTOCM_H__
 #define NFC_LTOCM_H__
 
+/// Largest LTO-CM image (type 3: 511 blocks of 32 bytes)
+#define LTOCM_MAX_IMAGE (511 * 32)
+
+/// libnfc device; declared here so programs without libnfc can use LTOCM_MAX_IMAGE
+struct nfc_device;
+
 bool ltocm_req_std(uint8_t *ltoStandard);
 bool ltocm_req_serial(uint8_t *serialNum, int *serialNumLen);
 bool ltocm_select(uint8_t *serialNum, uint8_t *retSelect, int *retLenSelect);
 bool ltocm_readblk(size_t block, uint8_t *retReadBlk, int *retLenReadBlk);
 bool ltocm_readblk_ext(size_t block, uint8_t *retReadBlk, int *retLenReadBlk);
 bool ltocm_readblkcnt(uint8_t *retReadBlk, int *retLenReadBlk);
+
+void ltocm_set_device(struct nfc_device *dev);
+bool ltocm_init_device(struct nfc_device *dev);
+bool ltocm_field_reset(void);
+bool ltocm_read_tag(uint8_t *ltoStandard, uint8_t *serialNum, uint8_t *image, size_t *imageLen);
 #endif